@@ -2,6 +2,8 @@
 #define _FORTIFY_SOURCE 0
 
 #define _XOPEN_SOURCE           /* Allow Apple's ucontext           */
+#define _DEFAULT_SOURCE         /* Allow mmap anonymous mapping     */
+#define _DARWIN_C_SOURCE        /* Allow Apple's anonymous mapping  */
 #define _CRT_SECURE_NO_WARNINGS /* Allow Windows unsafe functions   */
 
 #if __GNUC__
@@ -33,6 +35,12 @@
 #   define STATIC_INLINE    static /* Let the compiler do inline */
 #endif
 
+/* Running coroutine, NULL mean current is primary coroutine */
+THREAD_LOCAL Coroutine* s_runningCoroutine;
+
+/* Mark coroutine is end and return to its caller, only come back when the coroutine is reset (fibers) */
+static void Coroutine_finish(Coroutine* coroutine);
+
 #if defined(_WIN32)
 /* End of Windows Fiber version */
 #define VC_EXTRALEAN
@@ -40,6 +48,7 @@
 #include <Windows.h>
 
 THREAD_LOCAL void* s_threadFiber;
+THREAD_LOCAL void* s_transferValue; /* Value passed across SwitchToFiber */
 
 struct Coroutine 
 {
@@ -50,6 +59,11 @@ struct Coroutine
 
     CoroutineFn func;
     void*       args;
+
+    Coroutine*  caller;     /* Coroutine that resumed this one, NULL is the primary fiber */
+    bool        started;
+
+    Coroutine*  next;       /* Intrusive link: CoroutineQueue */
 };
 
 /* Coroutine Fiber callback
@@ -60,15 +74,16 @@ static void __stdcall Coroutine_entry(void* params)
     assert(params && "Internal logic error: params must be null.");
     assert(s_threadFiber && "Internal logic error: s_threadFiber must be initialized before run fiber.");
 
-    /* Run the routine */
+    /* The fiber never exits, a reset coroutine is resumed to run its new body */
     Coroutine* coroutine = (Coroutine*)params;
-    coroutine->func(coroutine->args);
-
-    /* Mark the coroutine is end */
-    coroutine->status = CoroutineStatus_Dead;
+    for (;;)
+    {
+        /* Run the routine */
+        coroutine->func(coroutine->args);
 
-    /* Return to primary fiber */
-    SwitchToFiber(s_threadFiber);
+        /* Return to the caller */
+        Coroutine_finish(coroutine);
+    }
 }
 
 Coroutine* Coroutine_create(int stackSize, CoroutineFn func, void* args)
@@ -79,10 +94,14 @@ Coroutine* Coroutine_create(int stackSize, CoroutineFn func, void* args)
         Coroutine* coroutine = (Coroutine*)malloc(sizeof(Coroutine) + validStackSize);
         if (coroutine)
         {
-            coroutine->status    = CoroutineStatus_Normal;
+            coroutine->status    = CoroutineStatus_Suspended;
             coroutine->stackSize = validStackSize;
+            coroutine->fiber     = NULL;
             coroutine->func      = func;
             coroutine->args      = args;
+            coroutine->caller    = NULL;
+            coroutine->started   = false;
+            coroutine->next      = NULL;
 
             return coroutine;
         }
@@ -95,43 +114,88 @@ void Coroutine_destroy(Coroutine* coroutine)
 {
     if (coroutine)
     {
-        DeleteFiber(coroutine->fiber);
+        if (coroutine->fiber)
+        {
+            DeleteFiber(coroutine->fiber);
+        }
         free(coroutine);
     }
 }
 
-STATIC_INLINE bool Coroutine_nativeStart(Coroutine* coroutine)
+/* Fibers own their stacks, only the control blocks can be shared */
+bool Coroutine_createBatch(int count, int stackSize, const CoroutineFn* funcs, void* const* args, Coroutine** coroutines)
 {
+    if (count <= 0 || !funcs || !coroutines)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        coroutines[i] = Coroutine_create(stackSize, funcs[i], args ? args[i] : NULL);
+        if (!coroutines[i])
+        {
+            while (i-- > 0)
+            {
+                Coroutine_destroy(coroutines[i]);
+            }
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Fibers own their stacks, there is nothing to pool */
+void Coroutine_setPoolLimit(int maxPerClass)
+{
+    (void)maxPerClass;
+}
+
+void Coroutine_trimPool(int keepPerClass)
+{
+    (void)keepPerClass;
+}
+
+STATIC_INLINE bool Coroutine_nativeStart(Coroutine* from, Coroutine* to, void** out)
+{
+    (void)from;
+
     if (!s_threadFiber)
     {
         s_threadFiber = ConvertThreadToFiber(NULL);
         assert(s_threadFiber != NULL && "Internal system error: OS cannot convert current thread to fiber.");
     }
 
-    HANDLE handle = CreateFiber((SIZE_T)coroutine->stackSize, Coroutine_entry, coroutine);
-    if (handle)
-    {
-        coroutine->fiber = handle;
-        SwitchToFiber(handle);
-        return true;
-    }
-    else
+    /* The fiber of a dead coroutine is parked at the end of its loop, ready to run the new body */
+    if (!to->fiber)
     {
-        return false;
+#if COROUTINE_STACK_MMAP
+        /* Only reserve the stack, the system commits pages on demand behind its guard page */
+        to->fiber = CreateFiberEx(0, (SIZE_T)to->stackSize, 0, Coroutine_entry, to);
+#else
+        to->fiber = CreateFiber((SIZE_T)to->stackSize, Coroutine_entry, to);
+#endif
+        if (!to->fiber)
+        {
+            return false;
+        }
     }
-}
 
-STATIC_INLINE bool Coroutine_nativeResume(Coroutine* coroutine)
-{
-    SwitchToFiber(coroutine->fiber);
+    s_transferValue = NULL;
+    SwitchToFiber(to->fiber);
+    *out = s_transferValue;
     return true;
 }
 
-STATIC_INLINE void Coroutine_nativeYield(Coroutine* coroutine)
+/* Switch from the running coroutine to other, NULL is the primary fiber of thread */
+STATIC_INLINE void* Coroutine_nativeSwitch(Coroutine* from, Coroutine* to, void* value)
 {
-    (void)coroutine;
+    (void)from;
 
-    SwitchToFiber(s_threadFiber);
+    s_transferValue = value;
+    SwitchToFiber(to ? to->fiber : s_threadFiber);
+    return s_transferValue;
 }
 
 #if 0
@@ -270,9 +334,17 @@ STATIC_INLINE int swapcontext(ucontext_t *oucp, const ucontext_t *ucp)
 /* Begin of Unix's ucontext version */
 
 #include <setjmp.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <ucontext.h>
 
+#if COROUTINE_STACK_MMAP
+#include <sys/mman.h>
+#   if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#   define MAP_ANONYMOUS MAP_ANON
+#   endif
+#endif
+
 /* Define the stack_t structure */
 #if defined(__linux__) && !defined(ANDROID) && !defined(__ANDROID__)
 #   ifndef __stack_t_defined
@@ -302,8 +374,24 @@ extern void makecontext(ucontext_t * uctx, void (*func)(), int argc, ...);
 #define DUMMYARGS long long _0, long long _1, long long _2, long long _3, 
 #endif
 
+/* Hand-written context switch: only save callee-saved registers, stack pointer and MXCSR/x87 control words.
+ * No signal mask is touched, so there is no syscall when switching or creating coroutine.
+ * Only available on x86-64 System V ABI.
+ */
+#ifndef SWITCH_CONTEXT_ASM
+#   if defined(__x86_64__) && defined(__linux__)
+#   define SWITCH_CONTEXT_ASM 1
+#   else
+#   define SWITCH_CONTEXT_ASM 0
+#   endif
+#endif
 
+/* Use ucontext for both create and switch, ignored when SWITCH_CONTEXT_ASM is enabled. 
+ * Otherwise create with ucontext, and switch with _setjmp/_longjmp.
+ */
+#ifndef STORE_CALLER_CONTEXT
 #define STORE_CALLER_CONTEXT 0
+#endif
 
 struct Coroutine
 {
@@ -312,95 +400,416 @@ struct Coroutine
     CoroutineFn     func;
     void*           args;
 
-#if STORE_CALLER_CONTEXT
-    ucontext_t      caller;
-    ucontext_t      callee;
-#else
+#if SWITCH_CONTEXT_ASM
+    void*           context;    /* Saved stack pointer, registers are pushed on the stack */
+#elif STORE_CALLER_CONTEXT
     ucontext_t      context;
+#else
     jmp_buf         jmpPoint;
 #endif
 
+    Coroutine*      caller;     /* Coroutine that resumed this one, NULL is the primary context of thread */
+    bool            started;
+
     int             stackSize;
-    char            stack[];
+    char*           stack;
+
+    struct CoroutineBatch* batch;       /* Owner memory block when made by Coroutine_createBatch */
+    int                    sizeClass;   /* Pool size class, -1 when the block is not poolable */
+    Coroutine*             next;        /* Intrusive link: pool free list, CoroutineQueue */
 };
 
-#if !STORE_CALLER_CONTEXT
-typedef struct CoroutineRunner
+#if SWITCH_CONTEXT_ASM
+/* Save callee-saved registers of the current context into *from, then restore the context to
+ * value is handed to the other side in rax, as the return value of its own Coroutine_switchContext
+ */
+extern void* Coroutine_switchContext(void** from, void* to, void* value) __attribute__((visibility("hidden")));
+
+/* First return address of a new context, call the entry with r12 as argument */
+extern void Coroutine_startContext(void) __attribute__((visibility("hidden")));
+
+__asm__(
+    ".pushsection .text\n"
+    ".p2align 4\n"
+    ".globl  Coroutine_switchContext\n"
+    ".hidden Coroutine_switchContext\n"
+    ".type   Coroutine_switchContext, @function\n"
+    "Coroutine_switchContext:\n"
+    "    movq    %rdx, %rax\n"
+    "    pushq   %rbp\n"
+    "    pushq   %rbx\n"
+    "    pushq   %r12\n"
+    "    pushq   %r13\n"
+    "    pushq   %r14\n"
+    "    pushq   %r15\n"
+    "    subq    $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw  4(%rsp)\n"
+    "    movq    %rsp, (%rdi)\n"
+    "    movq    %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw   4(%rsp)\n"
+    "    addq    $8, %rsp\n"
+    "    popq    %r15\n"
+    "    popq    %r14\n"
+    "    popq    %r13\n"
+    "    popq    %r12\n"
+    "    popq    %rbx\n"
+    "    popq    %rbp\n"
+    "    ret\n"
+    ".size   Coroutine_switchContext, .-Coroutine_switchContext\n"
+
+    ".p2align 4\n"
+    ".globl  Coroutine_startContext\n"
+    ".hidden Coroutine_startContext\n"
+    ".type   Coroutine_startContext, @function\n"
+    "Coroutine_startContext:\n"
+    "    movq    %r12, %rdi\n"
+    "    callq   *%r13\n"
+    "    ud2\n"
+    ".size   Coroutine_startContext, .-Coroutine_startContext\n"
+    ".popsection\n"
+);
+
+/* Layout of the frame that Coroutine_switchContext pops, from the lowest address */
+typedef struct CoroutineFrame
 {
-    Coroutine*  coroutine;
-
-    ucontext_t* context;
-    jmp_buf*    jmpPoint;
-} CoroutineRunner;
-
+    uint32_t    mxcsr;
+    uint16_t    fpucw;
+    uint16_t    padding;
+
+    void*       r15;
+    void*       r14;
+    void*       r13;
+    void*       r12;
+    void*       rbx;
+    void*       rbp;
+    void*       rip;
+} CoroutineFrame;
+
+THREAD_LOCAL void* s_threadContext;
+#else
+THREAD_LOCAL void* s_transferValue; /* Value passed across context switch */
+#   if STORE_CALLER_CONTEXT
+THREAD_LOCAL ucontext_t s_threadContext;
+#   else
 THREAD_LOCAL jmp_buf s_threadJmpPoint;
+#   endif
 #endif
 
-static void Coroutine_entry(DUMMYARGS unsigned int hiPart, unsigned int loPart)
+#if SWITCH_CONTEXT_ASM
+static void Coroutine_entry(Coroutine* coroutine)
 {
-#if !STORE_CALLER_CONTEXT
-    CoroutineRunner* runner = (CoroutineRunner*)(((long long)hiPart << 32) | (long long)loPart);
-    assert(runner && "context must not be mull.");
-
-    Coroutine* coroutine = runner->coroutine;
     assert(coroutine && "coroutine must not be mull.");
 
     /* Run the routine */
-    if (_setjmp(*runner->jmpPoint) == 0)
-    { 
-        ucontext_t tmp;
-        swapcontext(&tmp, runner->context);
-    }
-
     coroutine->func(coroutine->args);
 
-    /* Mark the coroutine is end */
-    coroutine->status = CoroutineStatus_Dead;
-    
-    /* Return to primary thread */
-    _longjmp(s_threadJmpPoint, 1);
+    /* Return to the caller, never come back */
+    Coroutine_finish(coroutine);
+}
 #else
+static void Coroutine_entry(DUMMYARGS unsigned int hiPart, unsigned int loPart)
+{
     Coroutine* coroutine = (Coroutine*)(((long long)hiPart << 32) | (long long)loPart);
     assert(coroutine && "coroutine must not be mull.");
 
     coroutine->func(coroutine->args);
 
-    /* Mark the coroutine is end */
-    coroutine->status = CoroutineStatus_Dead;
-    
-    /* Return to primary thread */
-    swapcontext(&coroutine->callee, &coroutine->caller);
+    /* Return to the caller, never come back */
+    Coroutine_finish(coroutine);
+}
+#endif
+
+#if COROUTINE_STACK_MMAP
+static size_t Coroutine_pageSize(void)
+{
+    static size_t pageSize;
+    if (!pageSize)
+    {
+        long value = sysconf(_SC_PAGESIZE);
+        pageSize = value > 0 ? (size_t)value : 4096;
+    }
+    return pageSize;
+}
+
+/* Size of the control block at the top of the mapping, keep the stack top 64 bytes aligned */
+#define COROUTINE_HEADER_SIZE ((sizeof(Coroutine) + 63) & ~(size_t)63)
+#endif
+
+#if COROUTINE_STACK_MMAP
+static char* Coroutine_mapMemory(size_t size)
+{
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#if defined(MAP_NORESERVE)
+    flags |= MAP_NORESERVE;
+#endif
+#if defined(MAP_STACK)
+    flags |= MAP_STACK;
+#endif
+
+    char* memory = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    return memory != MAP_FAILED ? memory : NULL;
+}
 #endif
+
+/* Size of the memory block hold a coroutine with its stack */
+static size_t Coroutine_blockSize(int stackSize)
+{
+#if COROUTINE_STACK_MMAP
+    size_t pageSize = Coroutine_pageSize();
+    return pageSize + (((size_t)stackSize + COROUTINE_HEADER_SIZE + pageSize - 1) & ~(pageSize - 1));
+#else
+    return (sizeof(Coroutine) + (size_t)stackSize + 15) & ~(size_t)15;
+#endif
+}
+
+/* Layout control block and stack of coroutine in the memory block
+ * @note: with COROUTINE_STACK_MMAP, the block is: guard page | stack | control block
+ */
+static Coroutine* Coroutine_placeBlock(char* memory, size_t blockSize)
+{
+#if COROUTINE_STACK_MMAP
+    size_t pageSize = Coroutine_pageSize();
+
+    /* Overflow hit the guard page and fault, instead of silently corrupt other memory */
+    if (mprotect(memory, pageSize, PROT_NONE) != 0)
+    {
+        return NULL;
+    }
+
+    Coroutine* coroutine = (Coroutine*)(memory + blockSize - COROUTINE_HEADER_SIZE);
+    coroutine->stack     = memory + pageSize;
+    coroutine->stackSize = (int)(blockSize - pageSize - COROUTINE_HEADER_SIZE);
+#else
+    Coroutine* coroutine = (Coroutine*)memory;
+    coroutine->stack     = (char*)(coroutine + 1);
+    coroutine->stackSize = (int)(blockSize - sizeof(Coroutine));
+#endif
+
+    coroutine->batch     = NULL;
+    coroutine->sizeClass = -1;
+    coroutine->next      = NULL;
+    return coroutine;
+}
+
+/* Allocate control block and stack of coroutine in one block */
+static Coroutine* Coroutine_allocate(int stackSize)
+{
+    size_t blockSize = Coroutine_blockSize(stackSize);
+
+#if COROUTINE_STACK_MMAP
+    char* memory = Coroutine_mapMemory(blockSize);
+#else
+    char* memory = (char*)malloc(blockSize);
+#endif
+    if (!memory)
+    {
+        return NULL;
+    }
+
+    Coroutine* coroutine = Coroutine_placeBlock(memory, blockSize);
+    if (!coroutine)
+    {
+#if COROUTINE_STACK_MMAP
+        munmap(memory, blockSize);
+#else
+        free(memory);
+#endif
+    }
+    return coroutine;
+}
+
+static void Coroutine_free(Coroutine* coroutine)
+{
+#if COROUTINE_STACK_MMAP
+    if (coroutine)
+    {
+        size_t pageSize = Coroutine_pageSize();
+        munmap(coroutine->stack - pageSize, pageSize + coroutine->stackSize + COROUTINE_HEADER_SIZE);
+    }
+#else
+    free(coroutine);
+#endif
+}
+
+/* Memory block shared by coroutines made by Coroutine_createBatch, released with the last coroutine */
+typedef struct CoroutineBatch
+{
+    int     refCount;
+    size_t  size;
+    char*   memory;
+} CoroutineBatch;
+
+static void Coroutine_releaseBatch(CoroutineBatch* batch)
+{
+    if (--batch->refCount == 0)
+    {
+#if COROUTINE_STACK_MMAP
+        munmap(batch->memory, batch->size);
+#else
+        free(batch->memory);
+#endif
+        free(batch);
+    }
+}
+
+/* Maximum pooled coroutines per size class per thread */
+#ifndef COROUTINE_POOL_LIMIT
+#define COROUTINE_POOL_LIMIT 64
+#endif
+
+enum
+{
+    COROUTINE_POOL_MIN_SHIFT    = 10,   /* Smallest size class: 1KB */
+    COROUTINE_POOL_CLASSES      = 21,   /* Largest size class: 1GB  */
+};
+
+typedef struct CoroutinePool
+{
+    Coroutine*  freeList[COROUTINE_POOL_CLASSES];
+    int         count[COROUTINE_POOL_CLASSES];
+} CoroutinePool;
+
+THREAD_LOCAL CoroutinePool  s_threadPool;
+THREAD_LOCAL int            s_threadPoolLimit = COROUTINE_POOL_LIMIT;
+
+static int Coroutine_sizeClass(int stackSize)
+{
+    int sizeClass = 0;
+    while (((size_t)1 << (sizeClass + COROUTINE_POOL_MIN_SHIFT)) < (size_t)stackSize)
+    {
+        if (++sizeClass == COROUTINE_POOL_CLASSES)
+        {
+            return -1;
+        }
+    }
+    return sizeClass;
+}
+
+/* Take a coroutine from the thread's pool, or allocate a new one with size rounded up to its size class */
+static Coroutine* Coroutine_acquire(int stackSize)
+{
+    int sizeClass = Coroutine_sizeClass(stackSize);
+    if (sizeClass < 0)
+    {
+        return Coroutine_allocate(stackSize);
+    }
+
+    Coroutine* coroutine = s_threadPool.freeList[sizeClass];
+    if (coroutine)
+    {
+        s_threadPool.freeList[sizeClass] = coroutine->next;
+        s_threadPool.count[sizeClass]--;
+        return coroutine;
+    }
+
+    coroutine = Coroutine_allocate(1 << (sizeClass + COROUTINE_POOL_MIN_SHIFT));
+    if (coroutine)
+    {
+        coroutine->sizeClass = sizeClass;
+    }
+    return coroutine;
+}
+
+/* Return a coroutine to the thread's pool, free it when its size class is full */
+static void Coroutine_release(Coroutine* coroutine)
+{
+    if (coroutine->batch)
+    {
+        Coroutine_releaseBatch(coroutine->batch);
+        return;
+    }
+
+    int sizeClass = coroutine->sizeClass;
+    if (sizeClass >= 0 && s_threadPool.count[sizeClass] < s_threadPoolLimit)
+    {
+        coroutine->next = s_threadPool.freeList[sizeClass];
+        s_threadPool.freeList[sizeClass] = coroutine;
+        s_threadPool.count[sizeClass]++;
+    }
+    else
+    {
+        Coroutine_free(coroutine);
+    }
 }
 
+void Coroutine_setPoolLimit(int maxPerClass)
+{
+    s_threadPoolLimit = maxPerClass > 0 ? maxPerClass : 0;
+    Coroutine_trimPool(s_threadPoolLimit);
+}
+
+void Coroutine_trimPool(int keepPerClass)
+{
+    for (int i = 0; i < COROUTINE_POOL_CLASSES; i++)
+    {
+        while (s_threadPool.count[i] > keepPerClass)
+        {
+            Coroutine* coroutine = s_threadPool.freeList[i];
+            s_threadPool.freeList[i] = coroutine->next;
+            s_threadPool.count[i]--;
+
+            Coroutine_free(coroutine);
+        }
+    }
+}
+
+#if SWITCH_CONTEXT_ASM
+/* Write the entry frame of coroutine on its stack, so the next switch run its body from the beginning */
+static void Coroutine_makeFrame(Coroutine* coroutine)
+{
+    /* Stack grows down, the entry must be call with 16 bytes aligned stack */
+    uintptr_t stackTop = ((uintptr_t)(coroutine->stack + coroutine->stackSize)) & ~(uintptr_t)15;
+    CoroutineFrame* frame = (CoroutineFrame*)stackTop - 1;
+
+    /* Inherit floating-point environment from the resumer, like getcontext does */
+    __asm__ volatile("stmxcsr %0" : "=m"(frame->mxcsr));
+    __asm__ volatile("fnstcw %0" : "=m"(frame->fpucw));
+
+    frame->padding  = 0;
+    frame->r15      = NULL;
+    frame->r14      = NULL;
+    frame->r13      = (void*)Coroutine_entry;
+    frame->r12      = (void*)coroutine;
+    frame->rbx      = NULL;
+    frame->rbp      = NULL;
+    frame->rip      = (void*)Coroutine_startContext;
+
+    coroutine->context = frame;
+}
+#else
+/* Make the context that run the entry of coroutine on its stack */
+static void Coroutine_makeContext(ucontext_t* context, ucontext_t* link, Coroutine* coroutine)
+{
+    getcontext(context);
+
+    context->uc_link            = link;
+    context->uc_stack.ss_sp     = coroutine->stack;
+    context->uc_stack.ss_size   = coroutine->stackSize;
+    context->uc_stack.ss_flags  = 0;
+
+    unsigned int hiPart = (unsigned int)((long long)coroutine >> 32);
+    unsigned int loPart = (unsigned int)((long long)coroutine & 0xFFFFFFFF);
+    makecontext(context, (void(*)())Coroutine_entry, 2, hiPart, loPart);
+}
+#endif
+
 Coroutine* Coroutine_create(int stackSize, CoroutineFn func, void* args)
 {
     if (func)
     {
         stackSize = stackSize <= 0 ? COROUTINE_STACK_SIZE : stackSize;
-        Coroutine* coroutine = (Coroutine*)malloc(sizeof(Coroutine) + stackSize);
+        Coroutine* coroutine = Coroutine_acquire(stackSize);
         if (coroutine)
         {
-            coroutine->status       = CoroutineStatus_Normal;
+            coroutine->status       = CoroutineStatus_Suspended;
             coroutine->func         = func;
             coroutine->args         = args;
-            coroutine->stackSize    = stackSize;
-
-#if !STORE_CALLER_CONTEXT
-            getcontext(&coroutine->context);
-
-            coroutine->context.uc_stack.ss_sp    = coroutine->stack;
-            coroutine->context.uc_stack.ss_size  = coroutine->stackSize;
-
-            ucontext_t tmp;
-            CoroutineRunner runner = { coroutine, &tmp, &coroutine->jmpPoint};
-
-            unsigned int hiPart = (unsigned int)((long long)(&runner) >> 32);
-            unsigned int loPart = (unsigned int)((long long)(&runner) & 0xFFFFFFFF);
-            makecontext(&coroutine->context, (void(*)())Coroutine_entry, 2, hiPart, loPart);
-            swapcontext(&tmp, &coroutine->context);
-#endif
+            coroutine->caller       = NULL;
+            coroutine->started      = false;
 
+            /* Entry frame is made on the first resume, the stack is not touched until then */
             return coroutine;
         }
     }
@@ -408,60 +817,138 @@ Coroutine* Coroutine_create(int stackSize, CoroutineFn func, void* args)
     return NULL;
 }
 
-void Coroutine_destroy(Coroutine* coroutine)
+bool Coroutine_createBatch(int count, int stackSize, const CoroutineFn* funcs, void* const* args, Coroutine** coroutines)
 {
-    free(coroutine);
-}
+    if (count <= 0 || !funcs || !coroutines)
+    {
+        return false;
+    }
 
-static int Coroutine_nativeStart(Coroutine* coroutine)
-{
-#if STORE_CALLER_CONTEXT
-    getcontext(&coroutine->callee);
+    for (int i = 0; i < count; i++)
+    {
+        if (!funcs[i])
+        {
+            return false;
+        }
+    }
 
-    coroutine->callee.uc_link           = &coroutine->caller;
-    coroutine->callee.uc_stack.ss_sp    = coroutine->stack;
-    coroutine->callee.uc_stack.ss_size  = coroutine->stackSize;
-    coroutine->callee.uc_stack.ss_flags = 0;
+    CoroutineBatch* batch = (CoroutineBatch*)malloc(sizeof(CoroutineBatch));
+    if (!batch)
+    {
+        return false;
+    }
 
-    unsigned int hiPart = (unsigned int)((long long)coroutine >> 32);
-    unsigned int loPart = (unsigned int)((long long)coroutine & 0xFFFFFFFF);
-    makecontext(&coroutine->callee, (void(*)())Coroutine_entry, 2, hiPart, loPart);
-    swapcontext(&coroutine->caller, &coroutine->callee);
+    /* Control blocks are packed together after the stacks, so creating only touch them */
+    stackSize = stackSize <= 0 ? COROUTINE_STACK_SIZE : stackSize;
+#if COROUTINE_STACK_MMAP
+    size_t pageSize     = Coroutine_pageSize();
+    size_t stackStride  = pageSize + (((size_t)stackSize + pageSize - 1) & ~(pageSize - 1));
+#else
+    size_t stackStride  = ((size_t)stackSize + 15) & ~(size_t)15;
+#endif
+    size_t stacksSize   = stackStride * (size_t)count;
 
-    return 1;
+    batch->refCount = count;
+    batch->size     = stacksSize + sizeof(Coroutine) * (size_t)count;
+#if COROUTINE_STACK_MMAP
+    batch->memory   = Coroutine_mapMemory(batch->size);
 #else
-    if (_setjmp(s_threadJmpPoint) == 0)
-    { 
-        _longjmp(coroutine->jmpPoint, 1);
+    batch->memory   = (char*)malloc(batch->size);
+#endif
+    if (!batch->memory)
+    {
+        free(batch);
+        return false;
     }
 
-    return 1;
+    Coroutine* blocks = (Coroutine*)(batch->memory + stacksSize);
+    for (int i = 0; i < count; i++)
+    {
+        Coroutine* coroutine = &blocks[i];
+        char*      stack     = batch->memory + stackStride * (size_t)i;
+
+#if COROUTINE_STACK_MMAP
+        if (mprotect(stack, pageSize, PROT_NONE) != 0)
+        {
+            batch->refCount = 1;
+            Coroutine_releaseBatch(batch);
+            return false;
+        }
+
+        coroutine->stack        = stack + pageSize;
+        coroutine->stackSize    = (int)(stackStride - pageSize);
+#else
+        coroutine->stack        = stack;
+        coroutine->stackSize    = (int)stackStride;
 #endif
+
+        coroutine->status       = CoroutineStatus_Suspended;
+        coroutine->func         = funcs[i];
+        coroutine->args         = args ? args[i] : NULL;
+        coroutine->caller       = NULL;
+        coroutine->started      = false;
+        coroutine->batch        = batch;
+        coroutine->sizeClass    = -1;
+        coroutine->next         = NULL;
+
+        coroutines[i] = coroutine;
+    }
+
+    return true;
+}
+
+void Coroutine_destroy(Coroutine* coroutine)
+{
+    if (coroutine)
+    {
+        Coroutine_release(coroutine);
+    }
 }
 
-static int Coroutine_nativeResume(Coroutine* coroutine)
+/* Switch from the running coroutine to a coroutine that has not started, NULL is the primary context of thread */
+static bool Coroutine_nativeStart(Coroutine* from, Coroutine* to, void** out)
 {
-#if STORE_CALLER_CONTEXT
-    swapcontext(&coroutine->caller, &coroutine->callee);
-    return 1;
+#if SWITCH_CONTEXT_ASM
+    Coroutine_makeFrame(to);
+    *out = Coroutine_switchContext(from ? &from->context : &s_threadContext, to->context, NULL);
+    return true;
+#elif STORE_CALLER_CONTEXT
+    Coroutine_makeContext(&to->context, NULL, to);
+    swapcontext(from ? &from->context : &s_threadContext, &to->context);
+
+    *out = s_transferValue;
+    return true;
 #else
-    if (_setjmp(s_threadJmpPoint) == 0)
+    /* The context is only needed to jump onto the new stack, later switches use jmpPoint */
+    ucontext_t context;
+    Coroutine_makeContext(&context, NULL, to);
+
+    if (_setjmp(from ? from->jmpPoint : s_threadJmpPoint) == 0)
     { 
-        _longjmp(coroutine->jmpPoint, 1);
+        setcontext(&context);
     }
-    return 1;
+
+    *out = s_transferValue;
+    return true;
 #endif
 }
 
-static void Coroutine_nativeYield(Coroutine* coroutine)
+/* Switch from the running coroutine to other, NULL is the primary context of thread */
+static void* Coroutine_nativeSwitch(Coroutine* from, Coroutine* to, void* value)
 {
-#if STORE_CALLER_CONTEXT
-    swapcontext(&coroutine->callee, &coroutine->caller);
+#if SWITCH_CONTEXT_ASM
+    return Coroutine_switchContext(from ? &from->context : &s_threadContext, to ? to->context : s_threadContext, value);
+#elif STORE_CALLER_CONTEXT
+    s_transferValue = value;
+    swapcontext(from ? &from->context : &s_threadContext, to ? &to->context : &s_threadContext);
+    return s_transferValue;
 #else
-    if (_setjmp(coroutine->jmpPoint) == 0)
+    s_transferValue = value;
+    if (_setjmp(from ? from->jmpPoint : s_threadJmpPoint) == 0)
     { 
-        _longjmp(s_threadJmpPoint, 1);
+        _longjmp(to ? to->jmpPoint : s_threadJmpPoint, 1);
     }
+    return s_transferValue;
 #endif
 }
 /* End of Unix's ucontext version */
@@ -469,40 +956,151 @@ static void Coroutine_nativeYield(Coroutine* coroutine)
 #error Unsupport version
 #endif
 
-/* Running coroutine, NULL mean current is primary coroutine */
-THREAD_LOCAL Coroutine* s_runningCoroutine;
+/* Make coroutine the running one, the current running coroutine become normal when it is the caller */
+STATIC_INLINE void Coroutine_enter(Coroutine* coroutine, Coroutine* caller)
+{
+    if (caller)
+    {
+        caller->status = CoroutineStatus_Normal;
+    }
 
-bool Coroutine_resume(Coroutine* coroutine)
+    coroutine->caller   = caller;
+    coroutine->status   = CoroutineStatus_Running;
+    s_runningCoroutine  = coroutine;
+}
+
+/* Detach coroutine from its caller, the caller is running again */
+STATIC_INLINE Coroutine* Coroutine_leave(Coroutine* coroutine, CoroutineStatus status)
 {
-    switch (Coroutine_status(coroutine))
+    Coroutine* caller = coroutine->caller;
+    if (caller)
     {
-    case CoroutineStatus_Normal:
-        s_runningCoroutine = coroutine;
-        coroutine->status = CoroutineStatus_Running;
+        caller->status = CoroutineStatus_Running;
+    }
 
-        return Coroutine_nativeStart(coroutine);
+    coroutine->caller   = NULL;
+    coroutine->status   = status;
+    s_runningCoroutine  = caller;
+    return caller;
+}
 
-    case CoroutineStatus_Suspended:
-        s_runningCoroutine = coroutine;
-        coroutine->status = CoroutineStatus_Running;
+/* Switch from the running coroutine to a suspended coroutine, start it if needed */
+STATIC_INLINE bool Coroutine_switchTo(Coroutine* from, Coroutine* to, void* in, void** out)
+{
+    if (to->started)
+    {
+        *out = Coroutine_nativeSwitch(from, to, in);
+        return true;
+    }
+
+    /* The body receives its args, nothing to hand over on start */
+    to->started = true;
+    if (Coroutine_nativeStart(from, to, out))
+    {
+        return true;
+    }
 
-        return Coroutine_nativeResume(coroutine);
+    to->started = false;
+    return false;
+}
 
-    default:
-        return false;
+bool Coroutine_resumeWith(Coroutine* coroutine, void* in, void** out)
+{
+    void* value = NULL;
+    bool  result = false;
+
+    if (Coroutine_status(coroutine) == CoroutineStatus_Suspended)
+    {
+        Coroutine* current = s_runningCoroutine;
+        Coroutine_enter(coroutine, current);
+
+        result = Coroutine_switchTo(current, coroutine, in, &value);
+        if (!result)
+        {
+            Coroutine_leave(coroutine, CoroutineStatus_Suspended);
+        }
     }
+
+    if (out)
+    {
+        *out = value;
+    }
+
+    return result;
+}
+
+bool Coroutine_resume(Coroutine* coroutine)
+{
+    return Coroutine_resumeWith(coroutine, NULL, NULL);
+}
+
+void* Coroutine_yieldWith(void* out)
+{
+    Coroutine* coroutine = s_runningCoroutine;
+    if (coroutine)
+    {
+        Coroutine* caller = Coroutine_leave(coroutine, CoroutineStatus_Suspended);
+        return Coroutine_nativeSwitch(coroutine, caller, out);
+    }
+
+    return NULL;
 }
 
 void Coroutine_yield(void)
 {
-    if (s_runningCoroutine && s_runningCoroutine->status == CoroutineStatus_Running)
+    Coroutine_yieldWith(NULL);
+}
+
+bool Coroutine_transfer(Coroutine* target)
+{
+    Coroutine* current = s_runningCoroutine;
+    if (!current || target == current || Coroutine_status(target) != CoroutineStatus_Suspended)
+    {
+        return false;
+    }
+
+    /* Target takes over the place of current in the resume chain */
+    Coroutine* caller = current->caller;
+    current->caller = NULL;
+    current->status = CoroutineStatus_Suspended;
+
+    target->caller      = caller;
+    target->status      = CoroutineStatus_Running;
+    s_runningCoroutine  = target;
+
+    void* value;
+    if (!Coroutine_switchTo(current, target, NULL, &value))
     {
-        Coroutine* coroutine = s_runningCoroutine;
-        s_runningCoroutine = NULL;
+        target->caller      = NULL;
+        target->status      = CoroutineStatus_Suspended;
+
+        current->caller     = caller;
+        current->status     = CoroutineStatus_Running;
+        s_runningCoroutine  = current;
+        return false;
+    }
+
+    return true;
+}
+
+static void Coroutine_finish(Coroutine* coroutine)
+{
+    Coroutine* caller = Coroutine_leave(coroutine, CoroutineStatus_Dead);
+    Coroutine_nativeSwitch(coroutine, caller, NULL);
+}
 
-        coroutine->status = CoroutineStatus_Suspended;
-        Coroutine_nativeYield(coroutine);
+bool Coroutine_reset(Coroutine* coroutine, CoroutineFn func, void* args)
+{
+    if (func && Coroutine_status(coroutine) == CoroutineStatus_Dead)
+    {
+        coroutine->status   = CoroutineStatus_Suspended;
+        coroutine->func     = func;
+        coroutine->args     = args;
+        coroutine->started  = false;
+        return true;
     }
+
+    return false;
 }
 
 #if COROUTINE_YIELD_SHORTNAME
@@ -512,9 +1110,38 @@ void yield(void)
 }
 #endif
 
-Coroutine* CoroutineRunning(void)
+Coroutine* Coroutine_running(void)
+{
+    return s_runningCoroutine;
+}
+
+void CoroutineQueue_push(CoroutineQueue* queue, Coroutine* coroutine)
+{
+    coroutine->next = NULL;
+    if (queue->tail)
+    {
+        queue->tail->next = coroutine;
+    }
+    else
+    {
+        queue->head = coroutine;
+    }
+    queue->tail = coroutine;
+}
+
+Coroutine* CoroutineQueue_pop(CoroutineQueue* queue)
 {
-    return s_runningCoroutine && (s_runningCoroutine->status == CoroutineStatus_Running) ? s_runningCoroutine : NULL;
+    Coroutine* coroutine = queue->head;
+    if (coroutine)
+    {
+        queue->head = coroutine->next;
+        if (!queue->head)
+        {
+            queue->tail = NULL;
+        }
+        coroutine->next = NULL;
+    }
+    return coroutine;
 }
 
 CoroutineStatus Coroutine_status(Coroutine* coroutine)
@@ -17,6 +17,13 @@
 #define COROUTINE_YIELD_SHORTNAME 0
 #endif
 
+// Reserve stacks from virtual memory, with a guard page below each stack.
+// Pages are committed only when touched, so large stacks only cost what they use.
+// Each guard page is a kernel memory mapping, so live coroutines are bounded by vm.max_map_count on Linux.
+#ifndef COROUTINE_STACK_MMAP
+#define COROUTINE_STACK_MMAP 0
+#endif
+
 /* BEGIN OF EXTERN "C" */
 #ifdef __cplusplus
 extern "C" {
@@ -42,7 +49,11 @@ typedef enum CoroutineStatus
 enum
 {
     /* Recommended stack size */
+#if COROUTINE_STACK_MMAP
+    COROUTINE_STACK_SIZE = 256 * 1024 /* 256KB, address space only */
+#else
     COROUTINE_STACK_SIZE = 2 * 1024 /* 2KB */
+#endif
 };
 
 typedef void(*CoroutineFn)(void* args);
@@ -51,15 +62,42 @@ typedef struct Coroutine Coroutine;
 
 /**
  * Creates a new coroutine, with body func and args.
+ * The stack is not touched until the first Coroutine_resume.
  * Return NULL if func is not valid or creation failed.
  */
 COROUTINE_API Coroutine*        Coroutine_create(int stackSize, CoroutineFn func, void* args);
 
+/**
+ * Creates count coroutines from one contiguous memory block, with body funcs[i] and args[i] (args can be NULL).
+ * Stores the coroutines in the coroutines array, the block is released when the last of them is destroyed.
+ * Return false if any func is not valid or creation failed, no coroutine is created in that case.
+ */
+COROUTINE_API bool              Coroutine_createBatch(int count, int stackSize, const CoroutineFn* funcs, void* const* args, Coroutine** coroutines);
+
 /**
  * Release coroutine memory usage
  */
 COROUTINE_API void              Coroutine_destroy(Coroutine* coroutine);
 
+/**
+ * Re-arm a dead coroutine with new body func and args, reuse its stack without reallocating.
+ * Return false if func is not valid or the coroutine is not dead.
+ */
+COROUTINE_API bool              Coroutine_reset(Coroutine* coroutine, CoroutineFn func, void* args);
+
+/**
+ * Set the maximum number of destroyed coroutines kept for reuse in each stack size class, on the calling thread.
+ * Coroutine_create takes from this pool before allocating, 0 disable pooling.
+ * Pooled coroutines over the new limit are released.
+ */
+COROUTINE_API void              Coroutine_setPoolLimit(int maxPerClass);
+
+/**
+ * Release pooled coroutines of the calling thread, keep at most keepPerClass in each stack size class.
+ * Call Coroutine_trimPool(0) before a thread exit to release all its pooled memory.
+ */
+COROUTINE_API void              Coroutine_trimPool(int keepPerClass);
+
 /**
  *  Returns the status of coroutine.
  *      - CoroutineStatus_Dead: the coroutine has finished its body function, or if it has stopped with an error. 
@@ -75,10 +113,16 @@ COROUTINE_API CoroutineStatus   Coroutine_status(Coroutine* coroutine);
 COROUTINE_API Coroutine*        Coroutine_running(void);
 
 /**
- * Suspends the execution of the calling coroutine, return to the coroutine of the thread.
+ * Suspends the execution of the calling coroutine, return to the coroutine that resumed it.
  */
 COROUTINE_API void              Coroutine_yield(void);
 
+/**
+ * Suspends the execution of the calling coroutine, hand value out to the resumer.
+ * Return the value in passed by the Coroutine_resumeWith that continues the coroutine.
+ */
+COROUTINE_API void*             Coroutine_yieldWith(void* out);
+
 #if COROUTINE_YIELD_SHORTNAME
 /**
  * Suspends the execution of the calling coroutine.
@@ -87,11 +131,48 @@ COROUTINE_API void              yield(void);
 #endif
 
 /**
- * Starts or continues the execution of coroutine.
+ * Starts or continues the execution of coroutine, the calling coroutine becomes normal until the resumed one yields.
  * Return true if resume success, false is otherwise.
  */
 COROUTINE_API bool              Coroutine_resume(Coroutine* coroutine);
 
+/**
+ * Starts or continues the execution of coroutine, hand value in to the coroutine.
+ * The value is returned by the Coroutine_yieldWith that suspended the coroutine,
+ * it is ignored when the coroutine starts, the body receives its args instead.
+ * When out is not NULL, stores the value passed to Coroutine_yieldWith, or NULL when the coroutine is finished.
+ * Return true if resume success, false is otherwise.
+ */
+COROUTINE_API bool              Coroutine_resumeWith(Coroutine* coroutine, void* in, void** out);
+
+
+/**
+ * Intrusive FIFO of coroutines, linked through the coroutines themselves, so queueing never allocates.
+ * A coroutine can only be in one queue at a time. Zero initialized is an empty queue.
+ */
+typedef struct CoroutineQueue
+{
+    Coroutine* head;
+    Coroutine* tail;
+} CoroutineQueue;
+
+/**
+ * Appends coroutine to the tail of queue.
+ */
+COROUTINE_API void              CoroutineQueue_push(CoroutineQueue* queue, Coroutine* coroutine);
+
+/**
+ * Removes and returns the head of queue, NULL when queue is empty.
+ */
+COROUTINE_API Coroutine*        CoroutineQueue_pop(CoroutineQueue* queue);
+
+/**
+ * Switches directly from the running coroutine to the suspended target, without going through the caller.
+ * The target takes over the place of the running coroutine: its yield returns to the caller of the running coroutine.
+ * The running coroutine is suspended, and continues when it is resumed or transferred to again.
+ * Return false if not called from a coroutine or target is not suspended.
+ */
+COROUTINE_API bool              Coroutine_transfer(Coroutine* target);
 
 /* END OF EXTERN "C" */
 #ifdef __cplusplus
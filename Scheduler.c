@@ -0,0 +1,572 @@
+#if defined(__linux__)
+#define _GNU_SOURCE             /* Allow syscall                    */
+#endif
+
+#include "Scheduler.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_MSC_VER) || (defined(_WIN32) && defined(__clang__)) || defined(__MINGW32__) || defined(__CYGWIN__)
+#   define THREAD_LOCAL     static __declspec(thread)
+#elif defined(__GNUC__) || defined(__clang__)
+#   define THREAD_LOCAL     static __thread
+#elif defined(__cplusplus)
+#   define THREAD_LOCAL     thread_local
+#else
+#   define THREAD_LOCAL     static
+#endif
+
+/* Work-stealing workers need futex and GCC atomics */
+#if defined(__linux__) && (defined(__GNUC__) || defined(__clang__))
+#define SCHEDULER_WORKERS 1
+#else
+#define SCHEDULER_WORKERS 0
+#endif
+
+typedef struct SchedulerWorker SchedulerWorker;
+
+typedef struct Scheduler
+{
+    CoroutineQueue      ready;
+
+    int                 count;      /* Live spawned coroutines          */
+    bool                parking;    /* The resumed coroutine is parking */
+
+    SchedulerUnlockFn   unlock;     /* Called after the parking coroutine is switched out */
+    void*               unlockArgs;
+
+    SchedulerWorker*    worker;     /* Not NULL on the threads of Scheduler_runWorkers */
+} Scheduler;
+
+THREAD_LOCAL Scheduler s_scheduler;
+
+#if SCHEDULER_WORKERS
+static bool Scheduler_pushWorkers(Coroutine* coroutine, bool spawn);
+#endif
+
+/* Handle the resumed coroutine after it gives the control back, return false when it is dead */
+static bool Scheduler_afterResume(Coroutine* coroutine, bool* requeue)
+{
+    if (Coroutine_status(coroutine) == CoroutineStatus_Dead)
+    {
+        Coroutine_destroy(coroutine);
+
+        *requeue = false;
+        return false;
+    }
+
+    if (s_scheduler.parking)
+    {
+        /* Owned by whoever will call Scheduler_ready */
+        SchedulerUnlockFn unlock = s_scheduler.unlock;
+        void*             args   = s_scheduler.unlockArgs;
+
+        s_scheduler.parking    = false;
+        s_scheduler.unlock     = NULL;
+        s_scheduler.unlockArgs = NULL;
+
+        if (unlock)
+        {
+            unlock(args);
+        }
+
+        *requeue = false;
+        return true;
+    }
+
+    *requeue = true;
+    return true;
+}
+
+Coroutine* Scheduler_spawn(int stackSize, CoroutineFn func, void* args)
+{
+    Coroutine* coroutine = Coroutine_create(stackSize, func, args);
+    if (coroutine)
+    {
+#if SCHEDULER_WORKERS
+        if (Scheduler_pushWorkers(coroutine, true))
+        {
+            return coroutine;
+        }
+#endif
+
+        s_scheduler.count++;
+        CoroutineQueue_push(&s_scheduler.ready, coroutine);
+    }
+    return coroutine;
+}
+
+void Scheduler_run(void)
+{
+    Coroutine* coroutine;
+    while ((coroutine = CoroutineQueue_pop(&s_scheduler.ready)) != NULL)
+    {
+        Coroutine_resume(coroutine);
+
+        bool requeue;
+        if (!Scheduler_afterResume(coroutine, &requeue))
+        {
+            s_scheduler.count--;
+        }
+        else if (requeue)
+        {
+            CoroutineQueue_push(&s_scheduler.ready, coroutine);
+        }
+    }
+}
+
+void Scheduler_park(void)
+{
+    Scheduler_parkWith(NULL, NULL);
+}
+
+void Scheduler_parkWith(SchedulerUnlockFn unlock, void* args)
+{
+    assert(Coroutine_running() && "Scheduler_park must be called from a coroutine.");
+
+    s_scheduler.parking    = true;
+    s_scheduler.unlock     = unlock;
+    s_scheduler.unlockArgs = args;
+    Coroutine_yield();
+}
+
+void Scheduler_ready(Coroutine* coroutine)
+{
+    assert(Coroutine_status(coroutine) == CoroutineStatus_Suspended && "Only suspended coroutine can be ready.");
+
+#if SCHEDULER_WORKERS
+    if (Scheduler_pushWorkers(coroutine, false))
+    {
+        return;
+    }
+#endif
+
+    CoroutineQueue_push(&s_scheduler.ready, coroutine);
+}
+
+#if SCHEDULER_WORKERS
+/* Begin of work-stealing workers */
+
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define CACHE_LINE_ALIGN __attribute__((aligned(64)))
+
+/* Array of the deque, grown by the owner, old arrays are kept until the end of run because thieves may read them */
+typedef struct SchedulerBuffer
+{
+    long                    capacity;
+    struct SchedulerBuffer* retired;
+    Coroutine*              items[];
+} SchedulerBuffer;
+
+/* Chase-Lev deque: the owner pushes at bottom, everyone takes at top */
+typedef struct SchedulerDeque
+{
+    long             top        CACHE_LINE_ALIGN;
+    long             bottom     CACHE_LINE_ALIGN;
+    SchedulerBuffer* buffer;
+} SchedulerDeque;
+
+struct SchedulerWorker
+{
+    SchedulerDeque  deque;
+
+    int             index;
+    unsigned        random;     /* Victim selection state */
+    unsigned        ticks;
+    pthread_t       thread;
+} CACHE_LINE_ALIGN;
+
+enum
+{
+    SCHEDULER_DEQUE_CAPACITY    = 256,
+    SCHEDULER_INJECT_INTERVAL   = 61,   /* Check the shared queue every few ticks, so it is not starved */
+};
+
+typedef struct SchedulerPool
+{
+    SchedulerWorker*    workers;
+    int                 workerCount;
+
+    bool                running;
+    bool                done;
+
+    long                live        CACHE_LINE_ALIGN;   /* Spawned coroutines not dead yet      */
+    int                 idle        CACHE_LINE_ALIGN;   /* Workers that are looking for sleep   */
+    int                 wakeSeq;                        /* Futex word, bumped on each wake      */
+
+    pthread_mutex_t     injectLock  CACHE_LINE_ALIGN;   /* Coroutines pushed from outside the workers */
+    CoroutineQueue      inject;
+    long                injectCount;
+} SchedulerPool;
+
+static SchedulerPool s_pool = { .injectLock = PTHREAD_MUTEX_INITIALIZER };
+
+static void Scheduler_futexWait(int* address, int value)
+{
+    syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void Scheduler_futexWake(int* address, int count)
+{
+    syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static bool SchedulerDeque_init(SchedulerDeque* deque)
+{
+    SchedulerBuffer* buffer = (SchedulerBuffer*)malloc(sizeof(SchedulerBuffer) + SCHEDULER_DEQUE_CAPACITY * sizeof(Coroutine*));
+    if (!buffer)
+    {
+        return false;
+    }
+
+    buffer->capacity = SCHEDULER_DEQUE_CAPACITY;
+    buffer->retired  = NULL;
+
+    deque->top      = 0;
+    deque->bottom   = 0;
+    deque->buffer   = buffer;
+    return true;
+}
+
+static void SchedulerDeque_free(SchedulerDeque* deque)
+{
+    SchedulerBuffer* buffer = deque->buffer;
+    while (buffer)
+    {
+        SchedulerBuffer* retired = buffer->retired;
+        free(buffer);
+        buffer = retired;
+    }
+    deque->buffer = NULL;
+}
+
+/* Owner only */
+static void SchedulerDeque_push(SchedulerDeque* deque, Coroutine* coroutine)
+{
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    long top    = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+
+    SchedulerBuffer* buffer = __atomic_load_n(&deque->buffer, __ATOMIC_RELAXED);
+    if (bottom - top >= buffer->capacity)
+    {
+        long             capacity = buffer->capacity * 2;
+        SchedulerBuffer* grown    = (SchedulerBuffer*)malloc(sizeof(SchedulerBuffer) + (size_t)capacity * sizeof(Coroutine*));
+        if (!grown)
+        {
+            abort();
+        }
+
+        grown->capacity = capacity;
+        grown->retired  = buffer;
+        for (long i = top; i < bottom; i++)
+        {
+            grown->items[i & (capacity - 1)] = __atomic_load_n(&buffer->items[i & (buffer->capacity - 1)], __ATOMIC_RELAXED);
+        }
+
+        __atomic_store_n(&deque->buffer, grown, __ATOMIC_RELEASE);
+        buffer = grown;
+    }
+
+    __atomic_store_n(&buffer->items[bottom & (buffer->capacity - 1)], coroutine, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+
+/* Any thread, the owner also takes from the top so yielded coroutines run in FIFO order */
+static Coroutine* SchedulerDeque_steal(SchedulerDeque* deque)
+{
+    for (;;)
+    {
+        long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+        if (top >= bottom)
+        {
+            return NULL;
+        }
+
+        SchedulerBuffer* buffer    = __atomic_load_n(&deque->buffer, __ATOMIC_ACQUIRE);
+        Coroutine*       coroutine = __atomic_load_n(&buffer->items[top & (buffer->capacity - 1)], __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&deque->top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        {
+            return coroutine;
+        }
+    }
+}
+
+/* Wake one sleeping worker after new work is available */
+static void Scheduler_notify(void)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&s_pool.idle, __ATOMIC_RELAXED) > 0)
+    {
+        __atomic_fetch_add(&s_pool.wakeSeq, 1, __ATOMIC_SEQ_CST);
+        Scheduler_futexWake(&s_pool.wakeSeq, 1);
+    }
+}
+
+/* Stop all workers */
+static void Scheduler_stop(void)
+{
+    __atomic_store_n(&s_pool.done, true, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&s_pool.wakeSeq, 1, __ATOMIC_SEQ_CST);
+    Scheduler_futexWake(&s_pool.wakeSeq, INT_MAX);
+}
+
+/* Push to the workers when called from one of them, or while they are running, return false otherwise */
+static bool Scheduler_pushWorkers(Coroutine* coroutine, bool spawn)
+{
+    SchedulerWorker* worker = s_scheduler.worker;
+    if (!worker && !__atomic_load_n(&s_pool.running, __ATOMIC_ACQUIRE))
+    {
+        return false;
+    }
+
+    if (spawn)
+    {
+        __atomic_fetch_add(&s_pool.live, 1, __ATOMIC_SEQ_CST);
+    }
+
+    if (worker)
+    {
+        SchedulerDeque_push(&worker->deque, coroutine);
+    }
+    else
+    {
+        pthread_mutex_lock(&s_pool.injectLock);
+        CoroutineQueue_push(&s_pool.inject, coroutine);
+        __atomic_store_n(&s_pool.injectCount, s_pool.injectCount + 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&s_pool.injectLock);
+    }
+
+    Scheduler_notify();
+    return true;
+}
+
+static Coroutine* Scheduler_popInject(void)
+{
+    if (__atomic_load_n(&s_pool.injectCount, __ATOMIC_RELAXED) == 0)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&s_pool.injectLock);
+    Coroutine* coroutine = CoroutineQueue_pop(&s_pool.inject);
+    if (coroutine)
+    {
+        __atomic_store_n(&s_pool.injectCount, s_pool.injectCount - 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&s_pool.injectLock);
+    return coroutine;
+}
+
+static Coroutine* Scheduler_findWork(SchedulerWorker* worker)
+{
+    Coroutine* coroutine;
+
+    if (++worker->ticks % SCHEDULER_INJECT_INTERVAL == 0 && (coroutine = Scheduler_popInject()) != NULL)
+    {
+        return coroutine;
+    }
+
+    if ((coroutine = SchedulerDeque_steal(&worker->deque)) != NULL)
+    {
+        return coroutine;
+    }
+
+    if ((coroutine = Scheduler_popInject()) != NULL)
+    {
+        return coroutine;
+    }
+
+    /* Steal from the others, start at a random victim so thieves spread out */
+    int count = s_pool.workerCount;
+    worker->random = worker->random * 1103515245u + 12345u;
+    int start = (int)((worker->random >> 16) % (unsigned)count);
+    for (int i = 0; i < count; i++)
+    {
+        SchedulerWorker* victim = &s_pool.workers[(start + i) % count];
+        if (victim != worker && (coroutine = SchedulerDeque_steal(&victim->deque)) != NULL)
+        {
+            return coroutine;
+        }
+    }
+
+    return NULL;
+}
+
+/* Sleep until new work is pushed, return false when the workers are stopped */
+static bool Scheduler_idle(SchedulerWorker* worker, Coroutine** found)
+{
+    int seq = __atomic_load_n(&s_pool.wakeSeq, __ATOMIC_SEQ_CST);
+    int idle = __atomic_add_fetch(&s_pool.idle, 1, __ATOMIC_SEQ_CST);
+
+    /* Recheck after announcing, a pusher that missed us has published its work before */
+    *found = Scheduler_findWork(worker);
+    if (*found)
+    {
+        __atomic_sub_fetch(&s_pool.idle, 1, __ATOMIC_SEQ_CST);
+        return true;
+    }
+
+    if (idle == s_pool.workerCount || __atomic_load_n(&s_pool.done, __ATOMIC_SEQ_CST))
+    {
+        /* Nobody is running: what is left is dead or parked forever */
+        Scheduler_stop();
+        return false;
+    }
+
+    Scheduler_futexWait(&s_pool.wakeSeq, seq);
+    __atomic_sub_fetch(&s_pool.idle, 1, __ATOMIC_SEQ_CST);
+    return !__atomic_load_n(&s_pool.done, __ATOMIC_SEQ_CST);
+}
+
+static void Scheduler_workerLoop(SchedulerWorker* worker)
+{
+    s_scheduler.worker = worker;
+
+    for (;;)
+    {
+        Coroutine* coroutine = Scheduler_findWork(worker);
+        if (!coroutine && !Scheduler_idle(worker, &coroutine))
+        {
+            break;
+        }
+
+        Coroutine_resume(coroutine);
+
+        bool requeue;
+        if (!Scheduler_afterResume(coroutine, &requeue))
+        {
+            if (__atomic_sub_fetch(&s_pool.live, 1, __ATOMIC_SEQ_CST) == 0)
+            {
+                Scheduler_stop();
+                break;
+            }
+        }
+        else if (requeue)
+        {
+            SchedulerDeque_push(&worker->deque, coroutine);
+            Scheduler_notify();
+        }
+    }
+
+    s_scheduler.worker = NULL;
+}
+
+static void* Scheduler_workerThread(void* args)
+{
+    Scheduler_workerLoop((SchedulerWorker*)args);
+
+    /* Coroutines died on this thread went to its pool */
+    Coroutine_trimPool(0);
+    return NULL;
+}
+
+void Scheduler_runWorkers(int workerCount)
+{
+    if (workerCount <= 1 || __atomic_load_n(&s_pool.running, __ATOMIC_ACQUIRE))
+    {
+        Scheduler_run();
+        return;
+    }
+
+    SchedulerWorker* workers = NULL;
+    if (posix_memalign((void**)&workers, 64, sizeof(SchedulerWorker) * (size_t)workerCount) != 0)
+    {
+        Scheduler_run();
+        return;
+    }
+    memset(workers, 0, sizeof(SchedulerWorker) * (size_t)workerCount);
+
+    int initialized = 0;
+    for (; initialized < workerCount; initialized++)
+    {
+        workers[initialized].index  = initialized;
+        workers[initialized].random = (unsigned)initialized * 2654435761u + 1u;
+        if (!SchedulerDeque_init(&workers[initialized].deque))
+        {
+            break;
+        }
+    }
+
+    if (initialized == workerCount)
+    {
+        s_pool.workers      = workers;
+        s_pool.workerCount  = workerCount;
+        s_pool.done         = false;
+        s_pool.idle         = 0;
+
+        /* Coroutines spawned on this thread before running are handed to the workers */
+        Coroutine* coroutine;
+        while ((coroutine = CoroutineQueue_pop(&s_scheduler.ready)) != NULL)
+        {
+            SchedulerDeque_push(&workers[0].deque, coroutine);
+        }
+        __atomic_add_fetch(&s_pool.live, s_scheduler.count, __ATOMIC_SEQ_CST);
+        s_scheduler.count = 0;
+
+        if (__atomic_load_n(&s_pool.live, __ATOMIC_SEQ_CST) > 0)
+        {
+            __atomic_store_n(&s_pool.running, true, __ATOMIC_RELEASE);
+
+            int started = 1;
+            for (; started < workerCount; started++)
+            {
+                if (pthread_create(&workers[started].thread, NULL, Scheduler_workerThread, &workers[started]) != 0)
+                {
+                    break;
+                }
+            }
+            s_pool.workerCount = started;
+
+            Scheduler_workerLoop(&workers[0]);
+
+            for (int i = 1; i < started; i++)
+            {
+                pthread_join(workers[i].thread, NULL);
+            }
+
+            __atomic_store_n(&s_pool.running, false, __ATOMIC_RELEASE);
+        }
+
+        /* Ready coroutines left by an early stop are returned to this thread */
+        for (int i = 0; i < s_pool.workerCount; i++)
+        {
+            while ((coroutine = SchedulerDeque_steal(&workers[i].deque)) != NULL)
+            {
+                CoroutineQueue_push(&s_scheduler.ready, coroutine);
+            }
+        }
+        while ((coroutine = Scheduler_popInject()) != NULL)
+        {
+            CoroutineQueue_push(&s_scheduler.ready, coroutine);
+        }
+
+        s_scheduler.count   = (int)__atomic_exchange_n(&s_pool.live, 0, __ATOMIC_SEQ_CST);
+        s_pool.workers      = NULL;
+        s_pool.workerCount  = 0;
+    }
+
+    for (int i = 0; i < initialized; i++)
+    {
+        SchedulerDeque_free(&workers[i].deque);
+    }
+    free(workers);
+}
+/* End of work-stealing workers */
+#else
+void Scheduler_runWorkers(int workerCount)
+{
+    (void)workerCount;
+    Scheduler_run();
+}
+#endif
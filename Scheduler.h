@@ -0,0 +1,69 @@
+#pragma once
+
+//
+// Run loop for coroutines: spawned coroutines are resumed in FIFO order until they are dead.
+// The ready queue is linked through the coroutines, scheduling never allocates.
+// Scheduler_runWorkers spreads the coroutines over many threads with work stealing (Linux only),
+// a coroutine may then continue on another thread after each suspension:
+// coroutine bodies must not keep the address of thread-local variables across Coroutine_yield.
+//
+
+#include "Coroutine.h"
+
+#ifndef SCHEDULER_API
+#define SCHEDULER_API
+#endif
+
+/* BEGIN OF EXTERN "C" */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Called with args after a parked coroutine is switched out */
+typedef void(*SchedulerUnlockFn)(void* args);
+
+/**
+ * Creates a new coroutine, with body func and args, and appends it to the ready queue of the calling thread.
+ * The coroutine is owned by the scheduler, it is destroyed when it is dead.
+ * Return NULL if func is not valid or creation failed.
+ */
+SCHEDULER_API Coroutine*    Scheduler_spawn(int stackSize, CoroutineFn func, void* args);
+
+/**
+ * Runs the spawned coroutines of the calling thread, until all of them are dead or parked.
+ * A coroutine that calls Coroutine_yield is appended again to the tail of the ready queue.
+ * @note: scheduled coroutines must not Coroutine_transfer to each other, the scheduler only tracks what it resumed.
+ */
+SCHEDULER_API void          Scheduler_run(void);
+
+/**
+ * Runs the spawned coroutines on workerCount threads: the calling thread and workerCount - 1 new threads.
+ * Each worker owns a Chase-Lev deque of ready coroutines and steals from the others when it runs dry,
+ * idle workers sleep on a futex. Return when all spawned coroutines are dead, or all workers are idle with only parked coroutines left.
+ * Fallback to Scheduler_run on platforms without futex.
+ */
+SCHEDULER_API void          Scheduler_runWorkers(int workerCount);
+
+/**
+ * Suspends the running coroutine without appending it to the ready queue.
+ * It continues after someone pass it to Scheduler_ready.
+ */
+SCHEDULER_API void          Scheduler_park(void);
+
+/**
+ * Suspends the running coroutine like Scheduler_park, then calls unlock(args) once the coroutine is switched out.
+ * A waker that takes the coroutine under the same lock can then pass it to Scheduler_ready from any thread.
+ */
+SCHEDULER_API void          Scheduler_parkWith(SchedulerUnlockFn unlock, void* args);
+
+/**
+ * Appends a parked coroutine to the ready queue of the calling thread, or of the workers when called from other threads.
+ */
+SCHEDULER_API void          Scheduler_ready(Coroutine* coroutine);
+
+/* END OF EXTERN "C" */
+#ifdef __cplusplus
+}
+#endif
+
+/* END OF FILE, LEAVE A NEWLINE */
@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "Scheduler.h"
+
+#include <time.h>
+
+enum
+{
+    WORKER_COUNT    = 1000,
+    YIELD_COUNT     = 1000,
+    MESSAGE_COUNT   = 100 * 1000,
+};
+
+static int counter;
+
+void Worker(void* args)
+{
+    (void)args;
+
+    for (int i = 0; i < YIELD_COUNT; i++)
+    {
+        counter++;
+        Coroutine_yield();
+    }
+}
+
+/* Ping-pong between two coroutines, each one parks until the other hands it a message */
+static Coroutine*   s_waiter;
+static int          s_mailbox;
+static int          s_received;
+
+void Consumer(void* args)
+{
+    (void)args;
+
+    while (s_received < MESSAGE_COUNT)
+    {
+        if (s_mailbox == 0)
+        {
+            s_waiter = Coroutine_running();
+            Scheduler_park();
+        }
+
+        s_received += s_mailbox;
+        s_mailbox = 0;
+    }
+}
+
+void Producer(void* args)
+{
+    (void)args;
+
+    for (int i = 0; i < MESSAGE_COUNT; i++)
+    {
+        s_mailbox = 1;
+        if (s_waiter)
+        {
+            Coroutine* waiter = s_waiter;
+            s_waiter = NULL;
+            Scheduler_ready(waiter);
+        }
+        Coroutine_yield();
+    }
+}
+
+#if defined(__linux__)
+#include <pthread.h>
+
+enum
+{
+    THREAD_COUNT    = 4,
+};
+
+/* Same workloads, but coroutines move between threads */
+static long             s_sharedCounter;
+
+static pthread_mutex_t  s_sharedLock = PTHREAD_MUTEX_INITIALIZER;
+static Coroutine*       s_sharedWaiter;
+static int              s_sharedMailbox;
+static int              s_sharedReceived;
+
+void SharedWorker(void* args)
+{
+    (void)args;
+
+    for (int i = 0; i < YIELD_COUNT; i++)
+    {
+        __atomic_fetch_add(&s_sharedCounter, 1, __ATOMIC_RELAXED);
+        Coroutine_yield();
+    }
+}
+
+static void UnlockShared(void* args)
+{
+    pthread_mutex_unlock((pthread_mutex_t*)args);
+}
+
+void SharedConsumer(void* args)
+{
+    (void)args;
+
+    pthread_mutex_lock(&s_sharedLock);
+    while (s_sharedReceived < MESSAGE_COUNT)
+    {
+        if (s_sharedMailbox == 0)
+        {
+            /* The lock is released after this coroutine is switched out, so the producer cannot ready it too early */
+            s_sharedWaiter = Coroutine_running();
+            Scheduler_parkWith(UnlockShared, &s_sharedLock);
+            pthread_mutex_lock(&s_sharedLock);
+            continue;
+        }
+
+        s_sharedReceived += s_sharedMailbox;
+        s_sharedMailbox = 0;
+    }
+    pthread_mutex_unlock(&s_sharedLock);
+}
+
+void SharedProducer(void* args)
+{
+    (void)args;
+
+    for (int i = 0; i < MESSAGE_COUNT; i++)
+    {
+        pthread_mutex_lock(&s_sharedLock);
+        s_sharedMailbox++;
+        Coroutine* waiter = s_sharedWaiter;
+        s_sharedWaiter = NULL;
+        pthread_mutex_unlock(&s_sharedLock);
+
+        if (waiter)
+        {
+            Scheduler_ready(waiter);
+        }
+        Coroutine_yield();
+    }
+}
+
+static int TestWorkers(void)
+{
+    printf("Run %d coroutines on %d threads, yield %d times each\n", WORKER_COUNT, THREAD_COUNT, YIELD_COUNT);
+
+    for (int i = 0; i < WORKER_COUNT; i++)
+    {
+        if (!Scheduler_spawn(0, SharedWorker, NULL))
+        {
+            fprintf(stderr, "Spawn coroutine failed!\n");
+            return 1;
+        }
+    }
+
+    clock_t ticks = clock();
+    Scheduler_runWorkers(THREAD_COUNT);
+
+    printf("===============================================================\n");
+    printf("=> Total time: %lfs\n", (double)(clock() - ticks) / CLOCKS_PER_SEC);
+
+    if (s_sharedCounter != WORKER_COUNT * YIELD_COUNT)
+    {
+        fprintf(stderr, "Expected %d steps, got %ld!\n", WORKER_COUNT * YIELD_COUNT, s_sharedCounter);
+        return 1;
+    }
+
+    printf("Pass %d messages through parked coroutine on %d threads\n", MESSAGE_COUNT, THREAD_COUNT);
+
+    Scheduler_spawn(0, SharedConsumer, NULL);
+    Scheduler_spawn(0, SharedProducer, NULL);
+    Scheduler_runWorkers(THREAD_COUNT);
+
+    if (s_sharedReceived != MESSAGE_COUNT)
+    {
+        fprintf(stderr, "Expected %d messages, got %d!\n", MESSAGE_COUNT, s_sharedReceived);
+        return 1;
+    }
+
+    return 0;
+}
+#else
+static int TestWorkers(void)
+{
+    return 0;
+}
+#endif
+
+int main(void)
+{
+    printf("Run %d coroutines, yield %d times each\n", WORKER_COUNT, YIELD_COUNT);
+
+    for (int i = 0; i < WORKER_COUNT; i++)
+    {
+        if (!Scheduler_spawn(0, Worker, NULL))
+        {
+            fprintf(stderr, "Spawn coroutine failed!\n");
+            return 1;
+        }
+    }
+
+    clock_t ticks = clock();
+    Scheduler_run();
+
+    printf("===============================================================\n");
+    printf("=> Total time: %lfs\n", (double)(clock() - ticks) / CLOCKS_PER_SEC);
+
+    if (counter != WORKER_COUNT * YIELD_COUNT)
+    {
+        fprintf(stderr, "Expected %d steps, got %d!\n", WORKER_COUNT * YIELD_COUNT, counter);
+        return 1;
+    }
+
+    printf("Pass %d messages through parked coroutine\n", MESSAGE_COUNT);
+
+    Scheduler_spawn(0, Consumer, NULL);
+    Scheduler_spawn(0, Producer, NULL);
+    Scheduler_run();
+
+    if (s_received != MESSAGE_COUNT)
+    {
+        fprintf(stderr, "Expected %d messages, got %d!\n", MESSAGE_COUNT, s_received);
+        return 1;
+    }
+
+    if (TestWorkers() != 0)
+    {
+        return 1;
+    }
+
+    printf("Scheduler done.\n");
+    return 0;
+}
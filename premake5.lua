@@ -20,6 +20,8 @@ do
     files {
         path.join(ROOT_DIR, "Coroutine.h"),
         path.join(ROOT_DIR, "Coroutine.c"),
+        path.join(ROOT_DIR, "Scheduler.h"),
+        path.join(ROOT_DIR, "Scheduler.c"),
         path.join(ROOT_DIR, "Coroutine_Test.c"),
     }
 